@@ -0,0 +1,80 @@
+//
+// Launch latency benchmark. Compares running a static-pie image in-process with
+// ElfLoader::run_in_process against launching a static image with the fork based
+// ElfLoader::exec.
+//
+
+#include <ElfParser.h>
+#include <ElfLoader.h>
+#include <algorithm>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+
+static Elf load(const std::string &filepath)
+{
+    std::ifstream stream(filepath, std::ifstream::in | std::ifstream::binary);
+    if(!stream.is_open())
+        throw std::runtime_error("Couldn't open '" + filepath + "'");
+
+    ElfParser parser;
+    return parser.parse(stream, filepath);
+}
+
+/*!
+ * Launches an image repeatedly, then prints latency statistics
+ *
+ * @param label Label to print results under
+ * @param iterations Number of launches
+ * @param launch Launches the image once
+ */
+static void run(const std::string &label, size_t iterations, const std::function<ElfLaunchResult()> &launch)
+{
+    std::vector<double> times;
+    size_t failures = 0;
+    for(size_t a = 0; a < iterations; ++a)
+    {
+        ElfLaunchResult result = launch();
+        if(!result.success || !result.exited)
+            ++failures;
+        times.emplace_back(std::chrono::duration<double, std::micro>(result.wall_time).count());
+    }
+
+    std::sort(times.begin(), times.end());
+    double mean = 0;
+    for(auto time : times)
+        mean += time / times.size();
+    fprintf(stderr, "%-12s %10.1f %10.1f %10.1f %10.1f %10zu\n", label.c_str(), mean, times[times.size() / 2],
+            times[times.size() * 99 / 100], times.front(), failures);
+}
+
+int main(int argc, char *argv[], char *envp[])
+{
+    if(argc < 2)
+    {
+        std::cout << "Usage: " << argv[0] << " <static-pie image> [static image for exec] [iterations]" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const size_t iterations = argc > 3 ? std::stoul(argv[3]) : 1000;
+    if(iterations == 0)
+    {
+        std::cout << "Iterations must be at least 1" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    //Results go to stderr, as the images and exec both write to stdout
+    ElfLoader loader;
+    fprintf(stderr, "%-12s %10s %10s %10s %10s %10s\n", "mode", "mean us", "p50 us", "p99 us", "min us", "failures");
+
+    Elf pie = load(argv[1]);
+    run("in-process", iterations, [&]() { return loader.run_in_process(pie, 0, nullptr, envp); });
+
+    //exec maps segments at their linked addresses, so needs a non-PIE image. The child reuses our stack,
+    //starting from argv, so it must be given our real argc, argv and envp, which the kernel laid out with the auxv.
+    if(argc > 2)
+    {
+        Elf exe = load(argv[2]);
+        run("exec", iterations, [&]() { return loader.exec(exe, argc, argv, envp); });
+    }
+    return 0;
+}
@@ -0,0 +1,198 @@
+//
+// NUMA placement benchmark. Launches a memory-bound workload pinned to the CPUs of
+// one node, with its memory bound to each node in turn, to compare local and
+// remote placement using the same placement code as ElfLoader::exec.
+//
+// Memory is placed in two ways, as in exec: faulted in by the child itself, as
+// the loader's allocations are, and written into the child by the parent with
+// process_vm_writev, as the ELF segments are.
+//
+
+#include <ElfPlacement.h>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static constexpr size_t buffer_size = 512 * 1024 * 1024;
+static constexpr size_t write_chunk_size = 1024 * 1024;
+static constexpr size_t passes = 5;
+
+/*!
+ * Runs the workload against a buffer which has already been faulted in, printing its results
+ *
+ * @param label Label to print results under
+ * @param buffer The buffer to use, buffer_size bytes long
+ * @param memory_node The node the memory is expected to be on
+ */
+static void run_workload(const std::string &label, uint64_t *buffer, int memory_node)
+{
+    const size_t count = buffer_size / sizeof(uint64_t);
+
+    //Check where the pages actually ended up
+    std::string misplaced;
+    try
+    {
+        size_t misplaced_pages = 0;
+        for(size_t a = 0; a < count; a += 4096 / sizeof(uint64_t))
+            misplaced_pages += ElfPlacement::node_of(&buffer[a]) != memory_node;
+        misplaced = std::to_string(misplaced_pages);
+    }
+    catch(const std::exception &e)
+    {
+        std::cout << "Failed to check placement for " << label << ": " << e.what() << std::endl;
+        misplaced = "unknown";
+    }
+
+    //Read bandwidth
+    volatile uint64_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(size_t pass = 0; pass < passes; ++pass)
+    {
+        uint64_t sum = 0;
+        for(size_t a = 0; a < count; ++a)
+            sum += buffer[a];
+        sink = sink + sum;
+    }
+    std::chrono::duration<double> read_time = std::chrono::steady_clock::now() - start;
+
+    //Write bandwidth
+    start = std::chrono::steady_clock::now();
+    for(size_t pass = 0; pass < passes; ++pass)
+        memset(buffer, (int)pass, buffer_size);
+    std::chrono::duration<double> write_time = std::chrono::steady_clock::now() - start;
+
+    const double gib = (double)(buffer_size * passes) / (1024 * 1024 * 1024);
+    printf("%-40s %12.2f %12.2f %12s\n", label.c_str(), gib / read_time.count(), gib / write_time.count(), misplaced.c_str());
+}
+
+static uint64_t *map_buffer()
+{
+    auto *buffer = (uint64_t*)mmap(nullptr, buffer_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if(buffer == MAP_FAILED)
+    {
+        std::cout << "Failed to mmap buffer: " << errno << std::endl;
+        _exit(EXIT_FAILURE);
+    }
+    return buffer;
+}
+
+/*!
+ * Forks a child with the given placement, which runs the workload
+ *
+ * @param label Label to print results under
+ * @param options Placement for the child
+ * @param memory_node The node the memory is expected to be on
+ * @param parent_written True to have the parent write the buffer into the child, false to have the child fault it in
+ */
+static void launch(const std::string &label, const ElfLaunchOptions &options, int memory_node, bool parent_written)
+{
+    int pipe_fds[2];
+    if(pipe(pipe_fds) != 0)
+        throw std::runtime_error("Failed to create pipe: " + std::to_string(errno));
+
+    std::cout.flush();
+    int pid = fork();
+    if(pid == 0)
+    {
+        close(pipe_fds[0]);
+        try
+        {
+            ElfPlacement::apply(options);
+        }
+        catch(const std::exception &e)
+        {
+            std::cout << "Failed to apply launch placement: " << e.what() << std::endl;
+            _exit(EXIT_FAILURE);
+        }
+
+        //Either fault the buffer in ourselves, or hand it to the parent and suspend until it's written, as the loader does
+        uint64_t *buffer = map_buffer();
+        if(parent_written)
+        {
+            write(pipe_fds[1], &buffer, sizeof(buffer));
+            kill(getpid(), SIGSTOP);
+        }
+        else
+        {
+            memset(buffer, 1, buffer_size);
+        }
+
+        run_workload(label, buffer, memory_node);
+        fflush(stdout);
+        _exit(EXIT_SUCCESS);
+    }
+    close(pipe_fds[1]);
+
+    int status = 0;
+    if(parent_written)
+    {
+        uint64_t *buffer = nullptr;
+        read(pipe_fds[0], &buffer, sizeof(buffer));
+        waitpid(pid, &status, WUNTRACED);
+        if(WIFSTOPPED(status))
+        {
+            //Same as ElfLoader::exec writing segments
+            ElfPlacement::ScopedPlacement write_placement(options);
+            std::string chunk(write_chunk_size, '\1');
+            for(size_t offset = 0; offset < buffer_size; offset += chunk.size())
+            {
+                iovec local_vec{chunk.data(), chunk.size()};
+                iovec remote_vec{(uint8_t*)buffer + offset, chunk.size()};
+                if(process_vm_writev(pid, &local_vec, 1, &remote_vec, 1, 0) != (ssize_t)chunk.size())
+                {
+                    std::cout << "Failed to write to child: " << errno << std::endl;
+                    kill(pid, SIGKILL);
+                    break;
+                }
+            }
+            kill(pid, SIGCONT);
+        }
+    }
+    close(pipe_fds[0]);
+
+    waitpid(pid, &status, 0);
+    if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+        std::cout << "Workload for " << label << " failed with: " << status << std::endl;
+}
+
+int main()
+{
+    std::vector<int> nodes = ElfPlacement::memory_nodes();
+    if(nodes.size() < 2)
+        std::cout << "Only one NUMA node with memory found, remote placement can't be measured." << std::endl;
+
+    //Workloads run on the first node, whilst we run on the last, so that anything we fault in without
+    //adopting the child's placement lands on the wrong node
+    const int cpu_node = nodes.front();
+    ElfLaunchOptions host_options;
+    host_options.cpus = ElfPlacement::node_cpus(nodes.back());
+    ElfPlacement::apply(host_options);
+
+    printf("%-40s %12s %12s %12s\n", "placement", "read GiB/s", "write GiB/s", "misplaced");
+    for(auto memory_node : nodes)
+    {
+        ElfLaunchOptions options;
+        options.cpus = ElfPlacement::node_cpus(cpu_node);
+        options.memory_policy = ElfLaunchOptions::MemoryPolicy::bind;
+        options.numa_nodes = {memory_node};
+        const std::string label = std::string(memory_node == cpu_node ? "local" : "remote") + " (cpu " + std::to_string(cpu_node) + ", mem " + std::to_string(memory_node) + ")";
+        launch(label + ", child faulted", options, memory_node, false);
+        launch(label + ", parent written", options, memory_node, true);
+    }
+
+    //Local and inherited policies place memory on the node of whoever faults it in
+    ElfLaunchOptions options;
+    options.cpus = ElfPlacement::node_cpus(cpu_node);
+    options.memory_policy = ElfLaunchOptions::MemoryPolicy::local;
+    launch("local policy (cpu " + std::to_string(cpu_node) + "), parent written", options, cpu_node, true);
+    options.memory_policy = ElfLaunchOptions::MemoryPolicy::inherit;
+    launch("inherit policy (cpu " + std::to_string(cpu_node) + "), parent written", options, cpu_node, true);
+    return 0;
+}
@@ -0,0 +1,274 @@
+//
+// Parser throughput benchmark. Generates a corpus of well formed and malformed
+// ELF files, then times ElfParser::parse and ElfParser::validate against each.
+//
+
+#include <ElfParser.h>
+#include <elf.h>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <unistd.h>
+
+struct CorpusEntry
+{
+    std::string name;
+    std::string data;
+    size_t iterations;
+};
+
+/*!
+ * Builds a minimal static x86_64 executable: a header, one PT_LOAD segment covering the payload,
+ * and a section table with a section name string table.
+ *
+ * @param section_count Number of progbits sections to generate, in addition to the null section and the shstrtab
+ * @param payload_size Size of the loadable payload in bytes
+ * @param shared_name_length If non-zero, every section shares a single name of this length
+ * @return The ELF file contents
+ */
+static std::string build_elf(size_t section_count, size_t payload_size, size_t shared_name_length = 0)
+{
+    //Section names first, as they determine the layout
+    std::string shstrtab(1, '\0');
+    const auto shstrtab_name = (uint32_t)shstrtab.size();
+    shstrtab.append(".shstrtab").push_back('\0');
+    std::vector<uint32_t> name_offsets;
+    const auto shared_name = (uint32_t)shstrtab.size();
+    if(shared_name_length > 0)
+        shstrtab.append(shared_name_length, 'n').push_back('\0');
+    for(size_t a = 0; a < section_count; ++a)
+    {
+        if(shared_name_length > 0)
+        {
+            name_offsets.emplace_back(shared_name);
+            continue;
+        }
+        name_offsets.emplace_back((uint32_t)shstrtab.size());
+        shstrtab.append(".s" + std::to_string(a)).push_back('\0');
+    }
+
+    const uint64_t payload_pos = sizeof(Elf64_Ehdr) + sizeof(Elf64_Phdr);
+    const uint64_t shstrtab_pos = payload_pos + payload_size;
+    const uint64_t shdr_pos = shstrtab_pos + shstrtab.size();
+    const size_t shdr_count = section_count + 2;
+
+    Elf64_Ehdr ehdr{};
+    memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+    ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr.e_type = ET_EXEC;
+    ehdr.e_machine = EM_X86_64;
+    ehdr.e_version = EV_CURRENT;
+    ehdr.e_entry = 0x400000 + payload_pos;
+    ehdr.e_phoff = sizeof(Elf64_Ehdr);
+    ehdr.e_shoff = shdr_pos;
+    ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr.e_phentsize = sizeof(Elf64_Phdr);
+    ehdr.e_phnum = 1;
+    ehdr.e_shentsize = sizeof(Elf64_Shdr);
+    ehdr.e_shnum = (uint16_t)shdr_count;
+    ehdr.e_shstrndx = 1;
+
+    Elf64_Phdr phdr{};
+    phdr.p_type = PT_LOAD;
+    phdr.p_flags = PF_R | PF_X;
+    phdr.p_offset = 0;
+    phdr.p_vaddr = 0x400000;
+    phdr.p_filesz = shstrtab_pos;
+    phdr.p_memsz = shstrtab_pos;
+    phdr.p_align = 0x1000;
+
+    std::vector<Elf64_Shdr> shdrs(shdr_count);
+    shdrs[1].sh_name = shstrtab_name;
+    shdrs[1].sh_type = SHT_STRTAB;
+    shdrs[1].sh_offset = shstrtab_pos;
+    shdrs[1].sh_size = shstrtab.size();
+    shdrs[1].sh_addralign = 1;
+    for(size_t a = 0; a < section_count; ++a)
+    {
+        //Split the payload between the sections
+        auto &shdr = shdrs[a + 2];
+        shdr.sh_name = name_offsets[a];
+        shdr.sh_type = SHT_PROGBITS;
+        shdr.sh_flags = SHF_ALLOC;
+        shdr.sh_offset = payload_pos + (payload_size * a) / section_count;
+        shdr.sh_size = payload_pos + (payload_size * (a + 1)) / section_count - shdr.sh_offset;
+        shdr.sh_addr = 0x400000 + shdr.sh_offset;
+        shdr.sh_addralign = 1;
+    }
+
+    std::string data;
+    data.append((char*)&ehdr, sizeof(ehdr));
+    data.append((char*)&phdr, sizeof(phdr));
+    data.append(payload_size, '\x90');
+    data.append(shstrtab);
+    data.append((char*)shdrs.data(), shdrs.size() * sizeof(Elf64_Shdr));
+    return data;
+}
+
+template<typename T>
+static void patch(std::string &data, uint64_t offset, T value)
+{
+    memcpy(&data[offset], &value, sizeof(value));
+}
+
+static std::vector<CorpusEntry> build_corpus()
+{
+    std::vector<CorpusEntry> corpus;
+    constexpr uint64_t ehdr_size = sizeof(Elf64_Ehdr);
+
+    corpus.push_back({"tiny", build_elf(1, 64), 100000});
+    corpus.push_back({"huge (64MiB)", build_elf(16, 64 * 1024 * 1024), 20});
+    corpus.push_back({"4096 sections", build_elf(4096, 4096 * 16), 1000});
+    corpus.push_back({"65000 sections", build_elf(65000, 65000), 100});
+
+    //Every section pointing at the same huge name, which is costly if each name is scanned and copied in full
+    corpus.push_back({"shared 1MiB name", build_elf(2000, 64, 1024 * 1024), 100});
+    corpus.push_back({"65535 shared names", build_elf(65533, 64, 1024 * 1024), 10});
+
+    //Cut off half way through the section table
+    {
+        std::string data = build_elf(4096, 4096 * 16);
+        data.resize(data.size() - 2048 * sizeof(Elf64_Shdr));
+        corpus.push_back({"truncated shdrs", std::move(data), 10000});
+    }
+
+    //Cut off inside of the ELF header itself
+    corpus.push_back({"truncated header", build_elf(1, 64).substr(0, 40), 100000});
+
+    //Maximum table counts, pointing at the end of a small file
+    {
+        std::string data = build_elf(1, 64);
+        patch(data, offsetof(Elf64_Ehdr, e_phnum), (uint16_t)0xFFFF);
+        patch(data, offsetof(Elf64_Ehdr, e_shnum), (uint16_t)0xFFFF);
+        corpus.push_back({"bogus counts", std::move(data), 100000});
+    }
+
+    //Table offset which wraps when the table length is added
+    {
+        std::string data = build_elf(1, 64);
+        patch(data, offsetof(Elf64_Ehdr, e_shoff), std::numeric_limits<uint64_t>::max() - 8);
+        corpus.push_back({"overflowing shoff", std::move(data), 100000});
+    }
+
+    //Entry sizes too small to hold an entry, which would otherwise make the tables overlap
+    {
+        std::string data = build_elf(1, 64);
+        patch(data, offsetof(Elf64_Ehdr, e_phentsize), (uint16_t)1);
+        corpus.push_back({"bad phentsize", std::move(data), 100000});
+    }
+
+    //Empty program header table at a junk position, which must not be seeked to
+    {
+        std::string data = build_elf(1, 64);
+        patch(data, offsetof(Elf64_Ehdr, e_phnum), (uint16_t)0);
+        patch(data, offsetof(Elf64_Ehdr, e_phoff), (uint64_t)0xFFFFFFFFFFFFFFF0);
+        corpus.push_back({"empty junk phoff", std::move(data), 100000});
+    }
+
+    //Loadable segment pointing past the end of the file
+    {
+        std::string data = build_elf(1, 64);
+        patch(data, ehdr_size + offsetof(Elf64_Phdr, p_offset), (uint64_t)1 << 40);
+        corpus.push_back({"bad segment", std::move(data), 100000});
+    }
+
+    //Loadable segment whose memory range wraps around the address space
+    {
+        std::string data = build_elf(1, 64);
+        patch(data, ehdr_size + offsetof(Elf64_Phdr, p_vaddr), (uint64_t)0xFFFFFFFFFFFFF000);
+        patch(data, ehdr_size + offsetof(Elf64_Phdr, p_memsz), (uint64_t)0x2000);
+        corpus.push_back({"wrapping segment", std::move(data), 100000});
+    }
+
+    //Section names outside of the name table, on a file with many sections
+    {
+        std::string data = build_elf(4096, 4096 * 16);
+        auto shoff = *(uint64_t*)&data[offsetof(Elf64_Ehdr, e_shoff)];
+        patch(data, shoff + 4095 * sizeof(Elf64_Shdr) + offsetof(Elf64_Shdr, sh_name), (uint32_t)0xFFFFFFF0);
+        corpus.push_back({"bad section name", std::move(data), 1000});
+    }
+
+    //Name table which isn't null terminated
+    {
+        std::string data = build_elf(1, 64);
+        auto shoff = *(uint64_t*)&data[offsetof(Elf64_Ehdr, e_shoff)];
+        auto strtab_size = *(uint64_t*)&data[shoff + sizeof(Elf64_Shdr) + offsetof(Elf64_Shdr, sh_size)];
+        patch(data, shoff + sizeof(Elf64_Shdr) + offsetof(Elf64_Shdr, sh_size), strtab_size - 1);
+        corpus.push_back({"unterminated name", std::move(data), 100000});
+    }
+
+    return corpus;
+}
+
+/*!
+ * Runs an operation against a file repeatedly
+ *
+ * @param filepath The file to open for each iteration
+ * @param iterations Number of times to run the operation
+ * @param op The operation to time
+ * @param error Set to the failure reason, if the operation fails
+ * @return Average nanoseconds per iteration
+ */
+static double time_op(const std::string &filepath, size_t iterations, const std::function<void(std::ifstream&)> &op, std::string &error)
+{
+    auto start = std::chrono::steady_clock::now();
+    for(size_t a = 0; a < iterations; ++a)
+    {
+        std::ifstream stream(filepath, std::ifstream::in | std::ifstream::binary);
+        try
+        {
+            op(stream);
+        }
+        catch(const std::exception &e)
+        {
+            error = e.what();
+        }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / iterations;
+}
+
+int main()
+{
+    //Write the corpus out to a temporary directory
+    char dir_template[] = "/tmp/elf_parser_bench.XXXXXX";
+    if(mkdtemp(dir_template) == nullptr)
+    {
+        std::cout << "Failed to create corpus directory: " << errno << std::endl;
+        return EXIT_FAILURE;
+    }
+    const std::string corpus_dir = dir_template;
+
+    std::vector<CorpusEntry> corpus = build_corpus();
+    for(auto &entry : corpus)
+    {
+        std::ofstream out(corpus_dir + "/" + std::to_string(&entry - corpus.data()), std::ofstream::binary);
+        out.write(entry.data.data(), entry.data.size());
+    }
+
+    ElfParser parser;
+    printf("%-20s %12s %14s %14s  %s\n", "case", "bytes", "parse ns/op", "validate ns/op", "result");
+    for(auto &entry : corpus)
+    {
+        const std::string filepath = corpus_dir + "/" + std::to_string(&entry - corpus.data());
+        std::string parse_error, validate_error;
+        double parse_ns = time_op(filepath, entry.iterations, [&](std::ifstream &stream) { parser.parse(stream, entry.name); }, parse_error);
+        double validate_ns = time_op(filepath, entry.iterations, [&](std::ifstream &stream) { parser.validate(stream); }, validate_error);
+        if(parse_error != validate_error)
+            std::cout << "Warn: parse and validate disagree on '" << entry.name << "'" << std::endl;
+
+        printf("%-20s %12zu %14.0f %14.0f  %s\n", entry.name.c_str(), entry.data.size(), parse_ns, validate_ns,
+               parse_error.empty() ? "ok" : ("rejected: " + parse_error).c_str());
+    }
+
+    //Clean up the corpus
+    for(size_t a = 0; a < corpus.size(); ++a)
+        unlink((corpus_dir + "/" + std::to_string(a)).c_str());
+    rmdir(corpus_dir.c_str());
+    return 0;
+}
@@ -0,0 +1,37 @@
+//
+// Options controlling how ElfLoader launches a program.
+//
+
+#ifndef ELFLOADER_ELFLAUNCHOPTIONS_H
+#define ELFLOADER_ELFLAUNCHOPTIONS_H
+#include <cstddef>
+#include <vector>
+
+class ElfLaunchOptions
+{
+public:
+    enum class MemoryPolicy
+    {
+        inherit,    //Keep the launcher thread's policy
+        local,      //Allocate on the node of the CPU doing the fault
+        bind,       //Only allocate from numa_nodes
+        preferred,  //Prefer the first node in numa_nodes, falling back to others
+        interleave, //Interleave pages across numa_nodes
+    };
+
+    //Open software perf counters (task-clock, context switches, page faults) on the child before it's resumed
+    bool perf_counters = false;
+
+    //CPUs the child may run on. Empty to inherit the launcher thread's affinity.
+    std::vector<int> cpus;
+
+    //NUMA memory policy for the child, applied before its segments are mapped. numa_nodes is ignored for inherit and local.
+    MemoryPolicy memory_policy = MemoryPolicy::inherit;
+    std::vector<int> numa_nodes;
+
+    //Stack size given to images run by ElfLoader::run_in_process. Must fit the arguments, environment and auxv, plus 64KiB.
+    size_t stack_size = 8 * 1024 * 1024;
+};
+
+
+#endif //ELFLOADER_ELFLAUNCHOPTIONS_H
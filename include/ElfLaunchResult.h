@@ -0,0 +1,45 @@
+//
+// Outcome and resource usage of a program launched by ElfLoader.
+//
+
+#ifndef ELFLOADER_ELFLAUNCHRESULT_H
+#define ELFLOADER_ELFLAUNCHRESULT_H
+#include <chrono>
+#include <cstdint>
+
+class ElfLaunchResult
+{
+public:
+    struct PerfCounters
+    {
+        bool available = false;          //False if the counters couldn't be opened, or weren't requested
+
+        //Set if the caller wasn't permitted to count kernel mode (perf_event_paranoid >= 2 without CAP_PERFMON).
+        //Context switches then always read 0 and only page faults taken in user mode are counted.
+        bool user_only = false;
+        uint64_t task_clock_ns = 0;      //Time spent on CPU after being resumed
+        uint64_t context_switches = 0;
+        uint64_t page_faults = 0;
+    };
+
+    bool success = false;                //True if the child initialised and was resumed. Says nothing about its exit code.
+    bool exited = false;                 //True if the child exited normally, exit_code is then valid
+    int exit_code = 0;
+    bool signaled = false;               //True if the child was killed by a signal, signal is then valid
+    int signal = 0;
+
+    //Resource usage of the child, from fork until it was reaped. This includes the loader stage.
+    //For in-process runs, these are the change in usage of the whole host process over the run, and max RSS is left at 0.
+    std::chrono::nanoseconds wall_time{0};
+    std::chrono::microseconds user_cpu{0};
+    std::chrono::microseconds system_cpu{0};
+    long max_rss_kb = 0;
+    long minor_faults = 0;
+    long major_faults = 0;
+
+    //Counted from the child being resumed, so exclude the loader stage. Not available for in-process runs.
+    PerfCounters perf;
+};
+
+
+#endif //ELFLOADER_ELFLAUNCHRESULT_H
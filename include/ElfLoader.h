@@ -6,7 +6,10 @@
 #define ELFLOADER_ELFLOADER_H
 
 
+#include <sys/resource.h>
 #include "Elf.h"
+#include "ElfLaunchOptions.h"
+#include "ElfLaunchResult.h"
 
 class ElfLoader
 {
@@ -16,13 +19,38 @@ public:
     /*!
      * Exec's an ELF file
      *
+     * The child reuses our stack from argv onwards, and rewrites the auxv which the kernel placed after envp,
+     * so argc, argv and envp must be exactly those passed to main. Copies, or an envp built elsewhere, are rejected.
+     *
+     * @throws std::invalid_argument if argv or envp is null, or envp doesn't directly follow argv
      * @param elf The parsed ELF file
-     * @param argc argc value. Number of elements in argv. But you know that. May be 0.
-     * @param argv argv value. This should be the one passed to your main, so the child can be renamed. May be nullptr.
-     * @param envp Environmental variables for the child.
-     * @return True on success, false on failure
+     * @param argc argc value passed to main
+     * @param argv argv value passed to main. argv[0] is overwritten with the image name, so the child is renamed.
+     * @param envp envp value passed to main. These become the child's environment variables.
+     * @param options Launch options, see ElfLaunchOptions.
+     * @return How the child exited, and the resources it used. success is false if the child failed to initialise,
+     *         or its segments couldn't be written, in which case it's killed.
+     */
+    ElfLaunchResult exec(Elf elf, int argc, char *argv[], char *envp[], const ElfLaunchOptions &options = {});
+
+    /*!
+     * Runs a static-pie ELF file inside of the current process, on a dedicated thread with its own stack and auxv.
+     * The image is mapped at a free base address with per-segment permissions, and unmapped once it exits.
+     * Its exit_group is trapped so only its thread exits, and brk is refused so its allocations don't touch our heap.
+     * Its mmap, munmap and mremap calls are trapped and recorded, and whatever it still has mapped is unmapped once it exits.
+     * Only mappings made through those calls on the image's thread are tracked, up to 4096 at once, beyond which mmap fails
+     * with ENOMEM. Other threads of the host are unaffected. Anything mapped by other means, such as shmat, is left behind.
+     * Only one image can be run in-process at a time, and it must not create threads, install signal handlers or crash.
+     *
+     * @param elf The parsed ELF file. Must be a static-pie.
+     * @param argc Number of elements in argv. May be 0, in which case the image is given just its name.
+     * @param argv Arguments for the image, including its name. May be nullptr.
+     * @param envp Environmental variables for the image. May be nullptr.
+     * @param options Launch options, see ElfLaunchOptions. perf_counters isn't supported.
+     * @throws An std::exception if the image can't be mapped, the placement can't be applied or the stack is too small
+     * @return How the image exited. success is false if its thread couldn't be started.
      */
-    bool exec(Elf elf, int argc = 0, char *argv[] = nullptr, char *envp[] = nullptr);
+    ElfLaunchResult run_in_process(const Elf &elf, int argc = 0, char *argv[] = nullptr, char *envp[] = nullptr, const ElfLaunchOptions &options = {});
 
 
 private:
@@ -51,7 +79,86 @@ private:
      */
     std::vector<Alloc> get_process_allocations(int pid);
 
+    struct MappedImage
+    {
+        uint8_t *addr;  //Start of the mapping
+        size_t len;     //Length of the mapping
+        uintptr_t base; //Load bias, added to the image's virtual addresses
+    };
+
+    /*!
+     * Maps the loadable segments of a position independent ELF file at a free address in our own process.
+     * The image must be an x86_64 executable marked DF_1_PIE, with an entry point in an executable segment,
+     * and segments which lie within the file and don't wrap the address space.
+     *
+     * @throws An std::exception if the image isn't runnable, or on failure
+     * @param elf The ELF file to map
+     * @return The mapping
+     */
+    MappedImage map_image(const Elf &elf);
+
+    /*!
+     * Checks whether an ELF file's dynamic section marks it as a position independent executable,
+     * distinguishing a static-pie from a shared library
+     *
+     * @param elf The ELF file
+     * @return True if DF_1_PIE is set
+     */
+    bool has_pie_flag(const Elf &elf);
+
+    /*!
+     * Gets the virtual address of an ELF file's program headers, before any load bias
+     *
+     * @param elf The ELF file
+     * @return The address, or 0 if the program headers aren't loaded
+     */
+    uint64_t program_header_addr(const Elf &elf);
+
+    /*!
+     * Builds the initial stack of an in-process image: argc, argv, envp and auxv, as the kernel would on exec
+     *
+     * @param elf The ELF file
+     * @throws An std::exception if the stack is too small
+     * @param image Where the ELF file has been mapped
+     * @param stack_bottom Lowest usable address of the stack
+     * @param stack_top Highest address of the stack
+     * @param argc Number of elements in argv
+     * @param argv Image arguments
+     * @param envp Image environment, null terminated
+     * @return The initial stack pointer
+     */
+    uintptr_t build_initial_stack(const Elf &elf, const MappedImage &image, uint8_t *stack_bottom, uint8_t *stack_top, int argc, char *argv[], char *envp[]);
+
     void write_to_pid(int pid, void *src_addr, size_t src_len, void *dest_addr, size_t dest_len);
+
+    /*!
+     * Opens software perf counters on a process. The counters start counting immediately,
+     * so this should be done whilst the process is suspended. If kernel events can't be counted,
+     * the counters are reopened counting user mode only.
+     *
+     * @param pid Pid of the process to count
+     * @param user_only Set to true if the counters exclude kernel mode
+     * @return The counter file descriptors, in ElfLaunchResult::PerfCounters order. Empty on failure.
+     */
+    std::vector<int> open_perf_counters(int pid, bool &user_only);
+
+    /*!
+     * Reads and closes counters opened by open_perf_counters
+     *
+     * @param fds The counter file descriptors
+     * @param user_only True if the counters exclude kernel mode
+     * @return The counter values
+     */
+    ElfLaunchResult::PerfCounters read_perf_counters(std::vector<int> &fds, bool user_only);
+
+    /*!
+     * Fills in the exit and resource usage fields of a result from a wait4 call
+     *
+     * @param result The result to fill in
+     * @param status Status from wait4
+     * @param usage Resource usage from wait4
+     */
+    void fill_result(ElfLaunchResult &result, int status, const rusage &usage);
 };
 
 
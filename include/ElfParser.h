@@ -5,6 +5,7 @@
 #ifndef ELFLOADER_ELFPARSER_H
 #define ELFLOADER_ELFPARSER_H
 #include <fstream>
+#include <string_view>
 #include "ElfHeader.h"
 #include "Elf.h"
 #include "ElfSectionHeader.h"
@@ -22,10 +23,52 @@ public:
      */
     Elf parse(std::ifstream &elf_stream, std::string name);
 
+    /*!
+     * Checks that an ELF file is loadable, without reading it in full.
+     * Only the header, the header tables and the last byte of the section name table
+     * are read, so bad input is rejected before any per-entry work is done.
+     *
+     * @throws An std::exception if the file is malformed or unsupported
+     * @param elf_stream Data stream to check, containing the ELF data
+     */
+    void validate(std::ifstream &elf_stream);
+
 private:
 
-    ElfProgramHeader parse_program_header64(std::ifstream &elf_stream);
-    ElfSectionHeader parse_section_header64(std::ifstream &elf_stream);
+    /*!
+     * Reads and sanity checks the ELF header, including that the header tables lie within the file
+     *
+     * @throws An std::exception on failure
+     * @param elf_stream Data stream to read from
+     * @param file_size Total size of the stream in bytes
+     * @return The parsed ELF header
+     */
+    ElfHeader parse_header(std::ifstream &elf_stream, uint64_t file_size);
+
+    std::vector<ElfProgramHeader> parse_program_headers(std::ifstream &elf_stream, const ElfHeader &header, uint64_t file_size);
+    std::vector<ElfSectionHeader> parse_section_headers(std::ifstream &elf_stream, const ElfHeader &header, uint64_t file_size);
+
+    /*!
+     * Checks that every section name starts within the section name string table, and is null terminated
+     *
+     * @throws An std::exception if a name lies outside of the string table
+     * @param section_headers Section headers to check
+     * @param strtab_size Size of the section name string table
+     * @param strtab_last Last byte of the section name string table. Ignored if the table is empty.
+     */
+    void check_section_names(const std::vector<ElfSectionHeader> &section_headers, uint64_t strtab_size, char strtab_last);
+
+    /*!
+     * Fills in section names from the section name string table. Names are truncated to a maximum length.
+     *
+     * @throws An std::exception if a name lies outside of the string table
+     * @param section_headers Section headers to name
+     * @param strtab Contents of the section name string table
+     */
+    void fill_section_names(std::vector<ElfSectionHeader> &section_headers, std::string_view strtab);
+
+    ElfProgramHeader parse_program_header64(const char *entry);
+    ElfSectionHeader parse_section_header64(const char *entry);
 };
 
 
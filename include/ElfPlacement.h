@@ -0,0 +1,84 @@
+//
+// CPU affinity and NUMA memory placement for launched programs.
+//
+
+#ifndef ELFLOADER_ELFPLACEMENT_H
+#define ELFLOADER_ELFPLACEMENT_H
+#include <sched.h>
+#include <vector>
+#include "ElfLaunchOptions.h"
+
+class ElfPlacement
+{
+public:
+    /*!
+     * Applies the CPU affinity and NUMA memory policy from a set of launch options to the calling thread
+     *
+     * @throws An std::exception on failure
+     * @param options The options to apply
+     */
+    static void apply(const ElfLaunchOptions &options);
+
+    /*!
+     * Sets the NUMA memory policy of the calling thread. Memory faulted in by this thread, including
+     * pages of another process written via process_vm_writev, is allocated according to this policy.
+     *
+     * @throws An std::exception on failure
+     * @param policy The policy to use
+     * @param nodes Nodes to use for the policy. Ignored for inherit and local.
+     */
+    static void set_memory_policy(ElfLaunchOptions::MemoryPolicy policy, const std::vector<int> &nodes);
+
+    /*!
+     * Gets the NUMA node that a page of memory has been placed on
+     *
+     * @throws An std::exception on failure
+     * @param addr Address within the page. Must have been faulted in.
+     * @return The node ID
+     */
+    static int node_of(void *addr);
+
+    /*!
+     * Gets the CPUs belonging to a NUMA node
+     *
+     * @throws An std::exception on failure
+     * @param node The node ID
+     * @return A list of CPU IDs
+     */
+    static std::vector<int> node_cpus(int node);
+
+    /*!
+     * Gets the NUMA nodes which have memory
+     *
+     * @return A list of node IDs. Contains only node 0 on systems without NUMA.
+     */
+    static std::vector<int> memory_nodes();
+
+    /*!
+     * Saves the calling thread's CPU affinity and memory policy, and applies those from a set of launch options until
+     * it goes out of scope. Only what the options change is saved and restored.
+     *
+     * Pages are allocated by whichever thread faults them in, under that thread's policy. MPOL_LOCAL, and the default
+     * policy, mean the node the faulting thread is running on, so the thread is pinned as well as adopting the policy.
+     */
+    class ScopedPlacement
+    {
+    public:
+        explicit ScopedPlacement(const ElfLaunchOptions &options);
+        ~ScopedPlacement();
+        ScopedPlacement(const ScopedPlacement&) = delete;
+        ScopedPlacement &operator=(const ScopedPlacement&) = delete;
+
+    private:
+        void restore();
+
+        bool restore_affinity = false;
+        cpu_set_t old_affinity{};
+        bool restore_policy = false;
+        int old_mode = 0;
+        std::vector<unsigned long> old_mask;
+    };
+};
+
+
+#endif //ELFLOADER_ELFPLACEMENT_H
@@ -17,6 +17,24 @@ int main(int argc, char *argv[], char *envp[])
 
     //Execute it
     ElfLoader loader;
-    loader.exec(binary, argc, argv, envp);
-    return 0;
+    ElfLaunchOptions options;
+    options.perf_counters = true;
+    ElfLaunchResult result = loader.exec(binary, argc, argv, envp, options);
+
+    //Report what it cost
+    using std::chrono::microseconds;
+    std::cout << "Wall time: " << std::chrono::duration_cast<microseconds>(result.wall_time).count() << "us"
+              << ", user: " << result.user_cpu.count() << "us"
+              << ", system: " << result.system_cpu.count() << "us"
+              << ", max RSS: " << result.max_rss_kb << "KiB"
+              << ", faults: " << result.minor_faults << " minor, " << result.major_faults << " major" << std::endl;
+    if(result.perf.available)
+    {
+        std::cout << "Task clock: " << result.perf.task_clock_ns << "ns"
+                  << ", context switches: " << result.perf.context_switches
+                  << ", page faults: " << result.perf.page_faults << std::endl;
+    }
+    if(result.signaled)
+        std::cout << "Killed by signal " << result.signal << std::endl;
+    return result.exited ? result.exit_code : EXIT_FAILURE;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 //
 
 #include <ElfLoader.h>
+#include <ElfPlacement.h>
 #include <sys/mman.h>
 #include <zconf.h>
 #include <cstring>
@@ -14,6 +15,22 @@
 #include <algorithm>
 #include <sys/uio.h>
 #include <elf.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/futex.h>
+#include <linux/seccomp.h>
+#include <linux/filter.h>
+#include <linux/audit.h>
+#include <sys/prctl.h>
+#include <sys/auxv.h>
+#include <sched.h>
+#include <csignal>
+#include <mutex>
+#include <random>
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#endif
 #include "../loader/loader.h"
 
 uint64_t round_up(uint64_t number, uint64_t multiple)
@@ -79,21 +96,39 @@ public:
 };
 
 typedef uint64_t (*LoaderFunc)(void *alloc_list_addr, uint64_t entry_point, uint64_t stack_end, uint64_t argc);
-bool ElfLoader::exec(Elf elf, int argc, char *argv[], char *envp[])
+ElfLaunchResult ElfLoader::exec(Elf elf, int argc, char *argv[], char *envp[], const ElfLaunchOptions &options)
 {
+    //The kernel places envp directly after argv's null terminator, with the auxv after envp's, and the loader relies on
+    //that layout. Anything else would have the child jump with a null stack, or rewrite unrelated memory as an auxv.
+    if(argv == nullptr || envp == nullptr || argc < 0 || envp != argv + argc + 1)
+        throw std::invalid_argument("exec must be given the argc, argv and envp passed to main");
+
     //Fork, creating a new process
+    ElfLaunchResult result;
+    auto launch_time = std::chrono::steady_clock::now();
     int pid = fork();
 
     //If we're the child, write the loader into memory, then execute it
     if(pid == 0)
     {
         //Set new process name if we can
-        if(argc > 0 && argv != nullptr)
+        if(argc > 0)
         {
             size_t name_len = strlen(argv[0]);
             strncpy(argv[0], elf.name.data(), name_len);
         }
 
+        //Pin ourselves and set the memory policy before anything is mapped, so the loader's allocations follow it
+        try
+        {
+            ElfPlacement::apply(options);
+        }
+        catch(const std::exception &e)
+        {
+            std::cout << "Failed to apply launch placement: " << e.what() << std::endl;
+            _exit(EXIT_FAILURE);
+        }
+
         //Figure out which sections of memory need to be allocated/de-allocated.
         //To do this, first enumerate our own address space to figure out what needs to be free'd in the new process.
         AllocationBuilder alloc_builder;
@@ -118,14 +153,18 @@ bool ElfLoader::exec(Elf elf, int argc, char *argv[], char *envp[])
             }
         }
 
-//        std::vector<Elf64_auxv_t> auxv;
-//        char **ptr = envp;
-//        while(ptr) ++ptr; ++ptr;
-//        auto *current = (Elf64_auxv_t*)ptr;
-//        while(current)
-//        {
-//            auxv.emplace_back(*current);
-//        }
+        //The loader reuses our stack, including the auxv the kernel gave us, which describes our image rather than
+        //the new one. Point the entries libc relies on at the new image. The auxv follows envp's null terminator.
+        char **env_end = envp;
+        while(*env_end) ++env_end;
+        for(auto *current = (Elf64_auxv_t*)(env_end + 1); current->a_type != AT_NULL; ++current)
+        {
+            if(current->a_type == AT_PHDR) current->a_un.a_val = program_header_addr(elf);
+            else if(current->a_type == AT_PHNUM) current->a_un.a_val = elf.header.program_header_table_entry_count;
+            else if(current->a_type == AT_PHENT) current->a_un.a_val = elf.header.program_header_table_entry_size;
+            else if(current->a_type == AT_ENTRY) current->a_un.a_val = elf.header.program_entry_pos;
+            else if(current->a_type == AT_BASE) current->a_un.a_val = 0;
+        }
 
         //Allocate memory for the loader + the allocation info
         std::string alloc_info = alloc_builder.build();
@@ -134,7 +173,7 @@ bool ElfLoader::exec(Elf elf, int argc, char *argv[], char *envp[])
         if(loader_addr == MAP_FAILED)
         {
             std::cout << "Failed to mmap loader: " << errno << std::endl;
-            return EXIT_FAILURE;
+            _exit(EXIT_FAILURE);
         }
 
         //Check that loader address is in unused space
@@ -147,7 +186,7 @@ bool ElfLoader::exec(Elf elf, int argc, char *argv[], char *envp[])
                (alloc.addr + alloc.len >= (uintptr_t)loader_addr && alloc.addr + alloc.len < (uintptr_t)loader_addr + payload_length))
             {
                 std::cout << "Loader got mmapped into needed memory. " << (int)alloc.type << ", 0x" << std::hex << alloc.addr << ", " << std::dec << alloc.len << std::endl;
-                return EXIT_FAILURE;
+                _exit(EXIT_FAILURE);
             }
         }
 
@@ -157,6 +196,18 @@ bool ElfLoader::exec(Elf elf, int argc, char *argv[], char *envp[])
         //Write alloc info
         memcpy(loader_addr + loader_len, alloc_info.data(), alloc_info.size());
 
+        //libc registers an rseq area in our TLS, which the loader is about to unmap. The kernel writes to it
+        //whenever we're rescheduled, so would kill us with SIGSEGV once it's gone. Unregister it first.
+        //The length must match the registered one, which may be the padded struct size rather than __rseq_size.
+#if __has_include(<sys/rseq.h>)
+        if(__rseq_size > 0)
+        {
+            auto *rseq_area = (uint8_t*)__builtin_thread_pointer() + __rseq_offset;
+            if(syscall(SYS_rseq, rseq_area, __rseq_size, RSEQ_FLAG_UNREGISTER, RSEQ_SIG) != 0)
+                syscall(SYS_rseq, rseq_area, sizeof(struct rseq), RSEQ_FLAG_UNREGISTER, RSEQ_SIG);
+        }
+#endif
+
         //Jump into the loader, we should not return from here
         ((LoaderFunc)loader_addr)(loader_addr + loader_len, elf.header.program_entry_pos, (uint64_t)argv, argc);
         abort();
@@ -165,34 +216,625 @@ bool ElfLoader::exec(Elf elf, int argc, char *argv[], char *envp[])
     //Wait for child to initialise. It should suspend itself on success.
     std::cout << "Child with PID " << pid << " spawned. Waiting for it to initialise and suspend." << std::endl;
     int status;
-    waitpid(pid, &status, WUNTRACED);
+    rusage usage{};
+    wait4(pid, &status, WUNTRACED, &usage);
     if(WIFEXITED(status) || WIFSIGNALED(status))
     {
         std::cout << "Child failed to initialise. Failed." << std::endl;
-        return false;
+        fill_result(result, status, usage);
+        result.wall_time = std::chrono::steady_clock::now() - launch_time;
+        return result;
     }
 
     //Child is now ready to have new code written into it, write the program headers
+    //Pages are allocated by whichever thread faults them in, which is us, so temporarily adopt the child's placement
     std::cout << "Child suspended. Writing new sections..." << std::endl;
-    for(auto &section : elf.program_headers)
+    try
     {
-        //Only write sections marked as loadable
-        if(section.type == ElfProgramHeader::Type::dynamic)
-            std::cout << "Warn: Image contains dynamic sections!" << std::endl;
-        if(section.type != ElfProgramHeader::Type::load && section.type != ElfProgramHeader::Type::tls)
-            continue;
+        ElfPlacement::ScopedPlacement write_placement(options);
+        for(auto &section : elf.program_headers)
+        {
+            //Only write sections marked as loadable
+            if(section.type == ElfProgramHeader::Type::dynamic)
+                std::cout << "Warn: Image contains dynamic sections!" << std::endl;
+            if(section.type != ElfProgramHeader::Type::load && section.type != ElfProgramHeader::Type::tls)
+                continue;
+
+            write_to_pid(pid, &elf.binary_data[section.file_offset], section.file_size, (void*)section.mem_offset, section.file_size);
+        }
+    }
+    catch(const std::exception &e)
+    {
+        //The child is still suspended and would never be resumed or reaped, so kill it off
+        std::cout << "Failed to write sections: " << e.what() << ". Killing child." << std::endl;
+        kill(pid, SIGKILL);
+        wait4(pid, &status, 0, &usage);
+        fill_result(result, status, usage);
+        result.wall_time = std::chrono::steady_clock::now() - launch_time;
+        return result;
+    }
 
-        write_to_pid(pid, &elf.binary_data[section.file_offset], section.file_size, (void*)section.mem_offset, section.file_size);
+    //Open perf counters whilst the child is still suspended, so that only the loaded program is counted
+    std::vector<int> perf_fds;
+    bool perf_user_only = false;
+    if(options.perf_counters)
+    {
+        perf_fds = open_perf_counters(pid, perf_user_only);
+        if(perf_fds.empty())
+            std::cout << "Warn: Failed to open perf counters: " << errno << std::endl;
     }
 
     //Sections are now written, resume the child
     std::cout << "Write complete. Resuming child..." << std::endl;
     kill(pid, SIGCONT);
+    result.success = true;
 
     //Wait for child to finish
-    waitpid(pid, &status, 0);
+    wait4(pid, &status, 0, &usage);
+    result.wall_time = std::chrono::steady_clock::now() - launch_time;
+    fill_result(result, status, usage);
+    if(!perf_fds.empty())
+        result.perf = read_perf_counters(perf_fds, perf_user_only);
     std::cout << "Child exited with: " << status << std::endl;
-    return true;
+    return result;
+}
+
+void ElfLoader::fill_result(ElfLaunchResult &result, int status, const rusage &usage)
+{
+    result.exited = WIFEXITED(status);
+    result.exit_code = result.exited ? WEXITSTATUS(status) : 0;
+    result.signaled = WIFSIGNALED(status);
+    result.signal = result.signaled ? WTERMSIG(status) : 0;
+    result.user_cpu = std::chrono::seconds(usage.ru_utime.tv_sec) + std::chrono::microseconds(usage.ru_utime.tv_usec);
+    result.system_cpu = std::chrono::seconds(usage.ru_stime.tv_sec) + std::chrono::microseconds(usage.ru_stime.tv_usec);
+    result.max_rss_kb = usage.ru_maxrss;
+    result.minor_faults = usage.ru_minflt;
+    result.major_faults = usage.ru_majflt;
+}
+
+std::vector<int> ElfLoader::open_perf_counters(int pid, bool &user_only)
+{
+    //Must match the order of the fields in ElfLaunchResult::PerfCounters
+    const uint64_t counters[] = {PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_SW_CONTEXT_SWITCHES, PERF_COUNT_SW_PAGE_FAULTS};
+
+    //Counting kernel events needs privileges at the default perf_event_paranoid, so fall back to user only counters
+    for(int exclude_kernel = 0; exclude_kernel <= 1; ++exclude_kernel)
+    {
+        std::vector<int> fds;
+        for(auto counter : counters)
+        {
+            perf_event_attr attr{};
+            attr.type = PERF_TYPE_SOFTWARE;
+            attr.size = sizeof(attr);
+            attr.config = counter;
+            attr.exclude_hv = 1;
+            attr.exclude_kernel = exclude_kernel;
+            int fd = (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+            if(fd < 0)
+                break;
+            fds.emplace_back(fd);
+        }
+        if(fds.size() == std::size(counters))
+        {
+            user_only = exclude_kernel;
+            return fds;
+        }
+
+        int err = errno;
+        for(auto open_fd : fds)
+            close(open_fd);
+        errno = err;
+        if(err != EACCES && err != EPERM)
+            break;
+    }
+    return {};
+}
+
+ElfLaunchResult::PerfCounters ElfLoader::read_perf_counters(std::vector<int> &fds, bool user_only)
+{
+    uint64_t values[3] = {};
+    ElfLaunchResult::PerfCounters counters;
+    counters.available = true;
+    counters.user_only = user_only;
+    for(size_t a = 0; a < fds.size(); ++a)
+    {
+        if(read(fds[a], &values[a], sizeof(values[a])) != sizeof(values[a]))
+            counters.available = false;
+        close(fds[a]);
+    }
+    fds.clear();
+
+    counters.task_clock_ns = values[0];
+    counters.context_switches = values[1];
+    counters.page_faults = values[2];
+    return counters;
+}
+
+//State shared with an in-process image's thread. Only one image can be run in-process at a time.
+static std::mutex in_process_lock;
+static volatile sig_atomic_t in_process_exited = 0;
+static volatile sig_atomic_t in_process_exit_code = 0;
+static volatile pid_t in_process_tid = 0;
+
+//Stack an in-process image must have free below its initial stack
+static constexpr size_t in_process_min_stack = 64 * 1024;
+
+//Mappings made by the image's thread, which are unmapped once it exits. Kept in a fixed table, as it's updated from a signal handler.
+//Once full, further mappings are refused with ENOMEM rather than being lost track of.
+struct InProcessRange
+{
+    uintptr_t addr;
+    size_t len;
+};
+static constexpr size_t in_process_max_ranges = 4096;
+static InProcessRange in_process_ranges[in_process_max_ranges];
+static size_t in_process_range_count = 0;
+
+struct InProcessStart
+{
+    uintptr_t entry_point;
+    uintptr_t stack_pointer;
+    volatile int error;
+};
+
+/*!
+ * Makes a syscall without going through libc, which sets errno in whichever TLS is current.
+ * Used on the image's thread, which shares our TLS and then has the image's.
+ *
+ * @return The syscall's return value, negative errno on failure
+ */
+static long raw_syscall(long number, long arg1 = 0, long arg2 = 0, long arg3 = 0, long arg4 = 0, long arg5 = 0)
+{
+    register long r10 asm("r10") = arg4;
+    register long r8 asm("r8") = arg5;
+    asm volatile("syscall" : "+a"(number) : "D"(arg1), "S"(arg2), "d"(arg3), "r"(r10), "r"(r8) : "rcx", "r11", "memory");
+    return number;
+}
+
+/*!
+ * Makes a syscall which the image's seccomp filter lets through untrapped, as the filter allows any syscall made
+ * from the instruction within it. Used by the SIGSYS handler to carry out the memory mapping calls it traps.
+ *
+ * @return The syscall's return value, negative errno on failure
+ */
+extern "C" long in_process_passthrough_syscall(long number, long arg1, long arg2, long arg3, long arg4, long arg5, long arg6);
+extern "C" const char in_process_passthrough_syscall_return[];
+asm(".text\n"
+    "in_process_passthrough_syscall:\n"
+    "    mov %rdi, %rax\n"
+    "    mov %rsi, %rdi\n"
+    "    mov %rdx, %rsi\n"
+    "    mov %rcx, %rdx\n"
+    "    mov %r8, %r10\n"
+    "    mov %r9, %r8\n"
+    "    mov 8(%rsp), %r9\n"
+    "    syscall\n"
+    "in_process_passthrough_syscall_return:\n"
+    "    ret\n");
+
+/*!
+ * Removes [addr, addr + len) from the image's tracked mappings, splitting any which it lies in the middle of.
+ * The caller must ensure there's room for one more range.
+ */
+static void in_process_untrack(uintptr_t addr, size_t len)
+{
+    if(len == 0)
+        return;
+
+    const uintptr_t end = addr + len;
+    for(size_t a = 0; a < in_process_range_count; ++a)
+    {
+        InProcessRange &range = in_process_ranges[a];
+        const uintptr_t range_end = range.addr + range.len;
+        if(range_end <= addr || range.addr >= end)
+            continue;
+
+        if(range.addr < addr && range_end > end)
+            in_process_ranges[in_process_range_count++] = {end, range_end - end};
+        if(range.addr < addr)
+        {
+            range.len = addr - range.addr;
+        }
+        else if(range_end > end)
+        {
+            range = {end, range_end - end};
+        }
+        else
+        {
+            range = in_process_ranges[--in_process_range_count];
+            --a;
+        }
+    }
+}
+
+/*!
+ * SIGSYS handler for syscalls trapped by the image's seccomp filter. exit_group exits just the image's thread,
+ * and mmap, munmap and mremap are carried out on the image's behalf, recording what it has mapped.
+ * Runs on the image's thread with the image's TLS, so only raw syscalls are safe.
+ */
+static void in_process_syscall_handler(int, siginfo_t *info, void *context)
+{
+    auto *ucontext = (ucontext_t*)context;
+    greg_t *regs = ucontext->uc_mcontext.gregs;
+    const long page_size = 4096; //Only x86_64 images are run, so pages are always 4KiB
+    auto page_round = [&](greg_t len) { return (size_t)((len + page_size - 1) & ~(page_size - 1)); };
+
+    if(info->si_syscall == SYS_exit_group)
+    {
+        //Record the exit code, then exit just this thread. The image's libc will have moved the thread's
+        //clear-tid address into its own TLS, so point it back at ours, so that we're woken on exit.
+        in_process_exit_code = (int)regs[REG_RDI];
+        in_process_exited = 1;
+        raw_syscall(SYS_set_tid_address, (long)&in_process_tid);
+        raw_syscall(SYS_exit, 0);
+        __builtin_unreachable();
+    }
+
+    if(info->si_syscall != SYS_mmap && info->si_syscall != SYS_munmap && info->si_syscall != SYS_mremap)
+        return;
+
+    //Replacing part of a range can split it, and a new range is then added, so leave room for two
+    if(in_process_range_count + 2 > in_process_max_ranges)
+    {
+        regs[REG_RAX] = -ENOMEM;
+        return;
+    }
+
+    long ret = in_process_passthrough_syscall(info->si_syscall, regs[REG_RDI], regs[REG_RSI], regs[REG_RDX], regs[REG_R10], regs[REG_R8], regs[REG_R9]);
+    regs[REG_RAX] = ret;
+    if((unsigned long)ret >= (unsigned long)-4095)
+        return;
+
+    if(info->si_syscall == SYS_mmap)
+    {
+        //A fixed mapping may replace part of an existing one
+        in_process_untrack(ret, page_round(regs[REG_RSI]));
+        in_process_ranges[in_process_range_count++] = {(uintptr_t)ret, page_round(regs[REG_RSI])};
+    }
+    else if(info->si_syscall == SYS_munmap)
+    {
+        in_process_untrack(regs[REG_RDI], page_round(regs[REG_RSI]));
+    }
+    else
+    {
+        //The old range goes unless it's kept by MREMAP_DONTUNMAP. The new range may overlap it if resized in place.
+        if(!(regs[REG_R10] & MREMAP_DONTUNMAP))
+            in_process_untrack(regs[REG_RDI], page_round(regs[REG_RSI]));
+        in_process_untrack(ret, page_round(regs[REG_RDX]));
+        in_process_ranges[in_process_range_count++] = {(uintptr_t)ret, page_round(regs[REG_RDX])};
+    }
+}
+
+/*!
+ * Entry point of the image's thread. This shares our TLS, so only makes raw syscalls.
+ * Placement is inherited from the thread which cloned it.
+ */
+static int in_process_thread(void *arg)
+{
+    auto *start = (InProcessStart*)arg;
+
+    //Trap exit_group so that only this thread exits, and refuse brk so the image's malloc uses mmap rather than our heap.
+    //mmap, munmap and mremap are trapped so the handler can record what the image maps, and are let through
+    //when the handler makes them. Filters only apply to the calling thread, so the rest of the process is unaffected.
+    const auto passthrough = (uint64_t)in_process_passthrough_syscall_return;
+    sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, arch)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, instruction_pointer) + 4),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)(passthrough >> 32), 0, 3),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, instruction_pointer)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)passthrough, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_exit_group, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRAP),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_brk, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ERRNO | 0), //brk returning 0 is treated as failure by libc
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_mmap, 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_munmap, 1, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_mremap, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRAP),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    sock_fprog program{sizeof(filter) / sizeof(filter[0]), filter};
+    long ret = raw_syscall(SYS_prctl, PR_SET_NO_NEW_PRIVS, 1);
+    if(ret == 0)
+        ret = raw_syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER, 0, (long)&program);
+    if(ret != 0)
+    {
+        start->error = (int)-ret;
+        return 1;
+    }
+
+    //Switch to the image's stack and jump to the entry point, as the loader does
+    asm volatile("mov %0, %%rsp\n"
+                 "xor %%ebp, %%ebp\n" //rbp is expected to be 0
+                 "xor %%edx, %%edx\n" //Contains a function pointer to be registered with atexit, don't register any!
+                 "jmp *%1\n"
+                 :: "D"(start->stack_pointer), "S"(start->entry_point) : "memory");
+    __builtin_unreachable();
+}
+
+ElfLaunchResult ElfLoader::run_in_process(const Elf &elf, int argc, char *argv[], char *envp[], const ElfLaunchOptions &options)
+{
+    std::lock_guard<std::mutex> guard(in_process_lock);
+    ElfLaunchResult result;
+    auto launch_time = std::chrono::steady_clock::now();
+    rusage usage_before{};
+    getrusage(RUSAGE_SELF, &usage_before);
+
+    //Adopt the requested placement until we're done. We fault in the image's pages, and its thread inherits our affinity and memory policy.
+    ElfPlacement::ScopedPlacement placement(options);
+
+    //Map the image and its stack. The lowest page of the stack is left inaccessible as a guard.
+    const size_t page_size = getpagesize();
+    const size_t stack_len = round_down(options.stack_size + page_size - 1, page_size) + page_size;
+    MappedImage image = map_image(elf);
+    auto *stack = (uint8_t*)mmap(nullptr, stack_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_STACK, -1, 0);
+    if(stack == MAP_FAILED)
+    {
+        munmap(image.addr, image.len);
+        throw std::runtime_error("Failed to mmap stack: " + std::to_string(errno));
+    }
+    mprotect(stack, page_size, PROT_NONE);
+
+    InProcessStart start{};
+    try
+    {
+        start.entry_point = image.base + elf.header.program_entry_pos;
+        start.stack_pointer = build_initial_stack(elf, image, stack + page_size, stack + stack_len, argc, argv, envp);
+    }
+    catch(const std::exception &e)
+    {
+        munmap(stack, stack_len);
+        munmap(image.addr, image.len);
+        throw;
+    }
+
+    //Handle the image's trapped syscalls, keeping the previous handler to restore afterwards
+    struct sigaction syscall_action{}, old_action{};
+    syscall_action.sa_sigaction = in_process_syscall_handler;
+    syscall_action.sa_flags = SA_SIGINFO;
+    sigemptyset(&syscall_action.sa_mask);
+    sigaction(SIGSYS, &syscall_action, &old_action);
+    in_process_exited = 0;
+    in_process_exit_code = 0;
+    in_process_range_count = 0;
+
+    //Start the image's thread. It shares our TLS until the image sets up its own, so the clone stack sits just below the initial stack.
+    std::cout.flush();
+    const int flags = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD | CLONE_SYSVSEM | CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID;
+    if(clone(in_process_thread, (void*)(start.stack_pointer - 256), flags, &start, &in_process_tid, nullptr, &in_process_tid) == -1)
+    {
+        std::cout << "Failed to start image thread: " << errno << std::endl;
+    }
+    else
+    {
+        //The kernel clears tid and wakes us when the thread exits
+        pid_t current;
+        while((current = in_process_tid) != 0)
+            syscall(SYS_futex, &in_process_tid, FUTEX_WAIT, current, nullptr, nullptr, 0);
+
+        if(start.error != 0)
+            std::cout << "Image thread failed to initialise: " << start.error << std::endl;
+        result.success = start.error == 0;
+        result.exited = in_process_exited != 0;
+        result.exit_code = in_process_exit_code;
+    }
+
+    //The thread has gone, so nothing else can be using what it mapped
+    sigaction(SIGSYS, &old_action, nullptr);
+    for(size_t a = 0; a < in_process_range_count; ++a)
+        munmap((void*)in_process_ranges[a].addr, in_process_ranges[a].len);
+    in_process_range_count = 0;
+    munmap(stack, stack_len);
+    munmap(image.addr, image.len);
+
+    //Max RSS can't be measured per run, as getrusage only gives the peak over our whole lifetime, so it's left at 0
+    rusage usage_after{};
+    getrusage(RUSAGE_SELF, &usage_after);
+    result.wall_time = std::chrono::steady_clock::now() - launch_time;
+    result.user_cpu = std::chrono::seconds(usage_after.ru_utime.tv_sec - usage_before.ru_utime.tv_sec) + std::chrono::microseconds(usage_after.ru_utime.tv_usec - usage_before.ru_utime.tv_usec);
+    result.system_cpu = std::chrono::seconds(usage_after.ru_stime.tv_sec - usage_before.ru_stime.tv_sec) + std::chrono::microseconds(usage_after.ru_stime.tv_usec - usage_before.ru_stime.tv_usec);
+    result.minor_faults = usage_after.ru_minflt - usage_before.ru_minflt;
+    result.major_faults = usage_after.ru_majflt - usage_before.ru_majflt;
+    return result;
+}
+
+ElfLoader::MappedImage ElfLoader::map_image(const Elf &elf)
+{
+    //Anything we can't run takes the whole process down with it, so be strict about what's accepted
+    if(elf.header.arch != ElfHeader::Architecture::x86_64)
+        throw std::logic_error("'" + elf.name + "' isn't an x86_64 image, so can't be run in-process");
+    if(elf.header.type != ElfHeader::Type::shared || !has_pie_flag(elf))
+        throw std::logic_error("'" + elf.name + "' isn't a position independent executable, so can't be run in-process");
+
+    //Find the range of memory the loadable segments cover
+    const uint64_t page_size = getpagesize();
+    uint64_t image_start = UINT64_MAX, image_end = 0;
+    bool entry_executable = false;
+    for(const auto &segment : elf.program_headers)
+    {
+        if(segment.type == ElfProgramHeader::Type::interpreted)
+            throw std::logic_error("'" + elf.name + "' requires an interpreter, only static-pie images can be run in-process");
+        if(segment.type != ElfProgramHeader::Type::load)
+            continue;
+
+        //The segment's pages, once rounded up, must not wrap, and its contents must come from the file
+        if(segment.mem_offset > UINT64_MAX - page_size || segment.mem_size > UINT64_MAX - page_size - segment.mem_offset)
+            throw std::logic_error("'" + elf.name + "' has a segment whose memory range wraps");
+        if(segment.file_size > segment.mem_size || segment.file_offset > elf.binary_data.size() || segment.file_size > elf.binary_data.size() - segment.file_offset)
+            throw std::logic_error("'" + elf.name + "' has a segment which lies outside of the file");
+
+        image_start = std::min(image_start, round_down(segment.mem_offset, page_size));
+        image_end = std::max(image_end, round_down(segment.mem_offset + segment.mem_size + page_size - 1, page_size));
+        if((segment.flags & ElfProgramHeader::executable) && contains(segment.mem_offset, segment.mem_offset + segment.mem_size, elf.header.program_entry_pos))
+            entry_executable = true;
+    }
+    if(image_start >= image_end)
+        throw std::logic_error("'" + elf.name + "' has no loadable segments");
+    if(elf.header.program_entry_pos == 0 || !entry_executable)
+        throw std::logic_error("'" + elf.name + "' has no entry point within an executable segment");
+
+    //Let the kernel pick a free base address for the whole image, then copy the segments in
+    MappedImage image{};
+    image.len = image_end - image_start;
+    image.addr = (uint8_t*)mmap(nullptr, image.len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE, -1, 0);
+    if(image.addr == MAP_FAILED)
+        throw std::runtime_error("Failed to mmap image: " + std::to_string(errno));
+    image.base = (uintptr_t)image.addr - image_start;
+    for(const auto &segment : elf.program_headers)
+    {
+        if(segment.type != ElfProgramHeader::Type::load)
+            continue;
+
+        //Checked above, but this is a write into our own address space, so check the destination directly too
+        const auto dest = (uintptr_t)image.base + segment.mem_offset;
+        if(dest < (uintptr_t)image.addr || segment.file_size > (uintptr_t)image.addr + image.len - dest)
+        {
+            munmap(image.addr, image.len);
+            throw std::logic_error("'" + elf.name + "' has a segment which lies outside of its mapping");
+        }
+        memcpy((void*)dest, &elf.binary_data[segment.file_offset], segment.file_size);
+    }
+
+    //Apply segment permissions. Segments may share a page at their edges, in which case the page gets the permissions of both.
+    std::vector<uint64_t> boundaries{image_start, image_end};
+    for(const auto &segment : elf.program_headers)
+    {
+        if(segment.type != ElfProgramHeader::Type::load)
+            continue;
+        boundaries.emplace_back(round_down(segment.mem_offset, page_size));
+        boundaries.emplace_back(round_down(segment.mem_offset + segment.mem_size + page_size - 1, page_size));
+    }
+    std::sort(boundaries.begin(), boundaries.end());
+    boundaries.erase(std::unique(boundaries.begin(), boundaries.end()), boundaries.end());
+    for(size_t a = 0; a + 1 < boundaries.size(); ++a)
+    {
+        int prot = PROT_NONE;
+        for(const auto &segment : elf.program_headers)
+        {
+            if(segment.type != ElfProgramHeader::Type::load)
+                continue;
+            if(!contains(round_down(segment.mem_offset, page_size), segment.mem_offset + segment.mem_size, boundaries[a]))
+                continue;
+            if(segment.flags & ElfProgramHeader::readable) prot |= PROT_READ;
+            if(segment.flags & ElfProgramHeader::writeable) prot |= PROT_WRITE;
+            if(segment.flags & ElfProgramHeader::executable) prot |= PROT_EXEC;
+        }
+        if(mprotect((void*)(image.base + boundaries[a]), boundaries[a + 1] - boundaries[a], prot) != 0)
+        {
+            munmap(image.addr, image.len);
+            throw std::runtime_error("Failed to set segment permissions: " + std::to_string(errno));
+        }
+    }
+
+    return image;
+}
+
+bool ElfLoader::has_pie_flag(const Elf &elf)
+{
+    for(const auto &segment : elf.program_headers)
+    {
+        if(segment.type != ElfProgramHeader::Type::dynamic)
+            continue;
+        if(segment.file_offset > elf.binary_data.size() || segment.file_size > elf.binary_data.size() - segment.file_offset)
+            return false;
+
+        for(uint64_t offset = 0; offset + sizeof(Elf64_Dyn) <= segment.file_size; offset += sizeof(Elf64_Dyn))
+        {
+            Elf64_Dyn entry{};
+            memcpy(&entry, &elf.binary_data[segment.file_offset + offset], sizeof(entry));
+            if(entry.d_tag == DT_NULL)
+                break;
+            if(entry.d_tag == DT_FLAGS_1)
+                return entry.d_un.d_val & DF_1_PIE;
+        }
+    }
+    return false;
+}
+
+uint64_t ElfLoader::program_header_addr(const Elf &elf)
+{
+    uint64_t phdr_addr = 0;
+    for(const auto &segment : elf.program_headers)
+    {
+        if(segment.type == ElfProgramHeader::Type::phdr)
+            return segment.mem_offset;
+        if(phdr_addr == 0 && segment.type == ElfProgramHeader::Type::load && contains(segment.file_offset, segment.file_offset + segment.file_size, (uint64_t)elf.header.program_header_table_pos))
+            phdr_addr = segment.mem_offset + (elf.header.program_header_table_pos - segment.file_offset);
+    }
+    return phdr_addr;
+}
+
+uintptr_t ElfLoader::build_initial_stack(const Elf &elf, const MappedImage &image, uint8_t *stack_bottom, uint8_t *stack_top, int argc, char *argv[], char *envp[])
+{
+    //Strings and random bytes go at the very top. Work out where, but don't write anything until we know it all fits.
+    uint8_t random_bytes[16];
+    std::random_device random;
+    for(auto &byte : random_bytes)
+        byte = (uint8_t)random();
+    const char platform_string[] = "x86_64";
+    const auto name = (uint64_t)stack_top - (elf.name.size() + 1);
+    const auto platform = name - sizeof(platform_string);
+    const auto random_addr = platform - sizeof(random_bytes);
+
+    //libc needs the program headers to find the TLS segment
+    const uint64_t phdr_addr = image.base + program_header_addr(elf);
+
+    //argc, argv, envp then auxv. With no arguments, just pass the image's name.
+    std::vector<uint64_t> words;
+    if(argc > 0 && argv != nullptr)
+    {
+        words.emplace_back(argc);
+        for(int a = 0; a < argc; ++a)
+            words.emplace_back((uint64_t)argv[a]);
+    }
+    else
+    {
+        words.emplace_back(1);
+        words.emplace_back(name);
+    }
+    words.emplace_back(0);
+    for(char **env = envp; env != nullptr && *env != nullptr; ++env)
+        words.emplace_back((uint64_t)*env);
+    words.emplace_back(0);
+
+    auto push_aux = [&](uint64_t type, uint64_t value) {
+        words.emplace_back(type);
+        words.emplace_back(value);
+    };
+    push_aux(AT_PHDR, phdr_addr);
+    push_aux(AT_PHENT, elf.header.program_header_table_entry_size);
+    push_aux(AT_PHNUM, elf.header.program_header_table_entry_count);
+    push_aux(AT_PAGESZ, getpagesize());
+    push_aux(AT_BASE, 0);
+    push_aux(AT_FLAGS, 0);
+    push_aux(AT_ENTRY, image.base + elf.header.program_entry_pos);
+    push_aux(AT_SECURE, 0);
+    push_aux(AT_RANDOM, random_addr);
+    push_aux(AT_PLATFORM, platform);
+    push_aux(AT_EXECFN, name);
+    for(auto type : {AT_UID, AT_EUID, AT_GID, AT_EGID, AT_HWCAP, AT_HWCAP2, AT_CLKTCK, AT_SYSINFO_EHDR, AT_MINSIGSTKSZ})
+    {
+        //Pass through what the kernel gave us
+        uint64_t value = getauxval(type);
+        if(value != 0 || type == AT_UID || type == AT_EUID || type == AT_GID || type == AT_EGID)
+            push_aux(type, value);
+    }
+    push_aux(AT_NULL, 0);
+
+    //Stack pointer must be 16 byte aligned, pointing at argc
+    auto stack_pointer = (random_addr - words.size() * sizeof(uint64_t)) & ~(uintptr_t)15;
+    if(random_addr < (uintptr_t)stack_bottom || stack_pointer < (uintptr_t)stack_bottom + in_process_min_stack)
+        throw std::runtime_error("Stack too small for the image's arguments and environment, need at least " + std::to_string((uintptr_t)stack_top - stack_pointer + in_process_min_stack) + " bytes");
+
+    memcpy((void*)name, elf.name.c_str(), elf.name.size() + 1);
+    memcpy((void*)platform, platform_string, sizeof(platform_string));
+    memcpy((void*)random_addr, random_bytes, sizeof(random_bytes));
+    memcpy((void*)stack_pointer, words.data(), words.size() * sizeof(uint64_t));
+    return stack_pointer;
 }
 
 std::vector<ElfLoader::Alloc> ElfLoader::get_process_allocations(int pid)
@@ -6,14 +6,112 @@
 #include <netinet/in.h>
 #include <iostream>
 #include <algorithm>
+#include <cstring>
+#include <limits>
+
+//Sizes of the 64bit on-disk structures, entry sizes smaller than these can't be parsed
+static constexpr uint64_t elf_header64_size = 64;
+static constexpr uint64_t program_header64_size = 56;
+static constexpr uint64_t section_header64_size = 64;
+
+//Longest section name that will be read, longer names are truncated
+static constexpr size_t max_section_name_length = 256;
+
+//Checks that [offset, offset + len) lies within a file of file_size bytes, without overflowing
+static bool in_file(uint64_t offset, uint64_t len, uint64_t file_size)
+{
+    return offset <= file_size && len <= file_size - offset;
+}
+
+//Only badbit throws, so a failed seek or short read has to be caught here, else later reads silently do nothing
+static void check_stream(const std::ifstream &elf_stream, const char *what)
+{
+    if(!elf_stream.good())
+        throw std::logic_error(std::string("Failed to read ") + what);
+}
+
+static uint64_t stream_size(std::ifstream &elf_stream)
+{
+    elf_stream.seekg(0, std::ifstream::end);
+    auto size = static_cast<uint64_t>(elf_stream.tellg());
+    elf_stream.seekg(0, std::ifstream::beg);
+    check_stream(elf_stream, "ELF file");
+    return size;
+}
 
 Elf ElfParser::parse(std::ifstream &elf_stream, std::string elf_name)
 {
     //Throw exception on fail, don't continue
     elf_stream.exceptions(std::ifstream::badbit);
 
+    //Read header and tables. Everything is bounds checked against the file size before it's read.
+    const uint64_t file_size = stream_size(elf_stream);
+    ElfHeader header = parse_header(elf_stream, file_size);
+    std::vector<ElfProgramHeader> program_headers = parse_program_headers(elf_stream, header, file_size);
+    std::vector<ElfSectionHeader> section_headers = parse_section_headers(elf_stream, header, file_size);
+
+    //Store parsed details into Elf object
+    Elf elf;
+    elf.header = header;
+    elf.program_headers = std::move(program_headers);
+    elf.section_headers = std::move(section_headers);
+    elf.name = std::move(elf_name);
+    elf.binary_data.resize(file_size);
+    elf_stream.seekg(0, std::ifstream::beg);
+    elf_stream.read(elf.binary_data.data(), elf.binary_data.size());
+    check_stream(elf_stream, "ELF file body");
+
+    //Read section header names from strtab section if it exists
+    //We have a strtab section, so fill in names
+    if(elf.header.section_header_name_index != 0 && elf.header.section_header_name_index < elf.section_headers.size())
+    {
+        auto &strtab = elf.section_headers[elf.header.section_header_name_index];
+        if(!in_file(strtab.file_offset, strtab.file_size, file_size))
+            throw std::logic_error("Section name table lies outside of the file");
+        fill_section_names(elf.section_headers, std::string_view(elf.binary_data).substr(strtab.file_offset, strtab.file_size));
+    }
+    else
+    {
+        std::cout << "Invalid section name index found in header. Not filling in section names." << std::endl;
+    }
+
+    return elf;
+}
+
+void ElfParser::validate(std::ifstream &elf_stream)
+{
+    elf_stream.exceptions(std::ifstream::badbit);
+
+    const uint64_t file_size = stream_size(elf_stream);
+    ElfHeader header = parse_header(elf_stream, file_size);
+    parse_program_headers(elf_stream, header, file_size);
+    std::vector<ElfSectionHeader> section_headers = parse_section_headers(elf_stream, header, file_size);
+
+    //Only the size and last byte of the name table are needed to check the names
+    if(header.section_header_name_index != 0 && header.section_header_name_index < section_headers.size())
+    {
+        auto &strtab = section_headers[header.section_header_name_index];
+        if(!in_file(strtab.file_offset, strtab.file_size, file_size))
+            throw std::logic_error("Section name table lies outside of the file");
+
+        char strtab_last = '\0';
+        if(strtab.file_size > 0)
+        {
+            elf_stream.seekg(strtab.file_offset + strtab.file_size - 1, std::ifstream::beg);
+            elf_stream.read(&strtab_last, 1);
+            check_stream(elf_stream, "section name table");
+        }
+        check_section_names(section_headers, strtab.file_size, strtab_last);
+    }
+}
+
+ElfHeader ElfParser::parse_header(std::ifstream &elf_stream, uint64_t file_size)
+{
+    if(file_size < elf_header64_size)
+        throw std::logic_error("File too small to contain an ELF header");
+
     //Read header, verifying magic
-    ElfHeader header;
+    ElfHeader header{};
     {
         std::string magic(4, '\0');
         elf_stream.read(magic.data(), magic.size());
@@ -21,9 +119,15 @@ Elf ElfParser::parse(std::ifstream &elf_stream, std::string elf_name)
             throw std::logic_error("Bad ELF header");
     }
 
-    //Read in the rest
+    //Ensure that it's 64bit before reading any word sized fields
     elf_stream.read((char*)&header.word, sizeof(header.word));
-    size_t pointer_length = (header.word == ElfHeader::WordSize::b32) ? 4 : 8;
+    if(header.word != ElfHeader::WordSize::b64)
+    {
+        throw std::logic_error("Cannot load unsupported 32bit ELF file");
+    }
+
+    //Read in the rest
+    size_t pointer_length = 8;
     elf_stream.read((char*)&header.endian, sizeof(header.word));
     elf_stream.read((char*)&header.version, sizeof(header.version));
     elf_stream.read((char*)&header.abi, sizeof(header.abi));
@@ -41,6 +145,7 @@ Elf ElfParser::parse(std::ifstream &elf_stream, std::string elf_name)
     elf_stream.read((char*)&header.section_header_table_entry_size, sizeof(header.section_header_table_entry_size));
     elf_stream.read((char*)&header.section_header_table_entry_count, sizeof(header.section_header_table_entry_count));
     elf_stream.read((char*)&header.section_header_name_index, sizeof(header.section_header_name_index));
+    check_stream(elf_stream, "ELF header");
 
     //Ensure that endianness is the same as ours
     if(htonl(47) == 47)
@@ -56,88 +161,142 @@ Elf ElfParser::parse(std::ifstream &elf_stream, std::string elf_name)
             throw std::logic_error("Can't load big-endian ELF file on little-endian system");
     }
 
-    //Ensure that it's 64bit
-    if(header.word != ElfHeader::WordSize::b64)
+    if(header.header_size < elf_header64_size)
+        throw std::logic_error("Bad ELF header size: " + std::to_string(header.header_size));
+
+    //Ensure that both header tables lie within the file. This also bounds the entry counts by the file size.
+    if(header.program_header_table_entry_count > 0)
     {
-        throw std::logic_error("Cannot load unsupported 32bit ELF file");
+        if(header.program_header_table_entry_size < program_header64_size)
+            throw std::logic_error("Bad program header entry size: " + std::to_string(header.program_header_table_entry_size));
+        if(!in_file(header.program_header_table_pos, (uint64_t)header.program_header_table_entry_count * header.program_header_table_entry_size, file_size))
+            throw std::logic_error("Program header table lies outside of the file");
+    }
+    if(header.section_header_table_entry_count > 0)
+    {
+        if(header.section_header_table_entry_size < section_header64_size)
+            throw std::logic_error("Bad section header entry size: " + std::to_string(header.section_header_table_entry_size));
+        if(!in_file(header.program_section_table_pos, (uint64_t)header.section_header_table_entry_count * header.section_header_table_entry_size, file_size))
+            throw std::logic_error("Section header table lies outside of the file");
+    }
+
+    return header;
+}
+
+std::vector<ElfProgramHeader> ElfParser::parse_program_headers(std::ifstream &elf_stream, const ElfHeader &header, uint64_t file_size)
+{
+    //Read the whole table in one go, rather than field by field
+    const size_t entry_size = header.program_header_table_entry_size;
+    std::string table(header.program_header_table_entry_count * entry_size, '\0');
+    if(!table.empty())
+    {
+        //The table position is only meaningful if there are entries, seeking to a junk one would fail the stream
+        elf_stream.seekg(header.program_header_table_pos, std::ifstream::beg);
+        elf_stream.read(table.data(), table.size());
+        check_stream(elf_stream, "program header table");
     }
 
-    //Read program headers
     std::vector<ElfProgramHeader> program_headers;
-    elf_stream.seekg(header.program_header_table_pos, std::ifstream::beg);
+    program_headers.reserve(header.program_header_table_entry_count);
     for(size_t a = 0; a < header.program_header_table_entry_count; ++a)
     {
-        ElfProgramHeader program_header = parse_program_header64(elf_stream);
+        ElfProgramHeader program_header = parse_program_header64(&table[a * entry_size]);
+
+        //Segments which get written into the child must come from within the file
+        if(program_header.type == ElfProgramHeader::Type::load || program_header.type == ElfProgramHeader::Type::tls)
+        {
+            if(!in_file(program_header.file_offset, program_header.file_size, file_size))
+                throw std::logic_error("Program header " + std::to_string(a) + " lies outside of the file");
+            if(program_header.file_size > program_header.mem_size)
+                throw std::logic_error("Program header " + std::to_string(a) + " has a file size larger than its memory size");
+            if(program_header.mem_size > std::numeric_limits<uint64_t>::max() - program_header.mem_offset)
+                throw std::logic_error("Program header " + std::to_string(a) + " has a memory range which wraps");
+        }
         program_headers.emplace_back(program_header);
     }
+    return program_headers;
+}
 
-    //Read section headers
-    std::vector<ElfSectionHeader> section_headers;
-    elf_stream.seekg(header.program_section_table_pos, std::ifstream::beg);
-    for(size_t a = 0; a < header.section_header_table_entry_count; ++a)
+std::vector<ElfSectionHeader> ElfParser::parse_section_headers(std::ifstream &elf_stream, const ElfHeader &header, uint64_t file_size)
+{
+    const size_t entry_size = header.section_header_table_entry_size;
+    std::string table(header.section_header_table_entry_count * entry_size, '\0');
+    if(!table.empty())
     {
-        ElfSectionHeader section_header = parse_section_header64(elf_stream);
-        section_headers.emplace_back(section_header);
+        elf_stream.seekg(header.program_section_table_pos, std::ifstream::beg);
+        elf_stream.read(table.data(), table.size());
+        check_stream(elf_stream, "section header table");
     }
 
-    //Store parsed details into Elf object
-    Elf elf;
-    elf.header = header;
-    elf.program_headers = std::move(program_headers);
-    elf.section_headers = std::move(section_headers);
-    elf.name = std::move(elf_name);
-    elf_stream.seekg(0, std::ifstream::end);
-    elf.binary_data.resize(static_cast<unsigned long>(elf_stream.tellg()));
-    elf_stream.seekg(0, std::ifstream::beg);
-    elf_stream.read(elf.binary_data.data(), elf.binary_data.size());
-
-    //Read section header names from strtab section if it exists
-    //We have a strtab section, so fill in names
-    ElfSectionHeader *shstrtab = nullptr;
-    if(elf.header.section_header_name_index < elf.section_headers.size())
+    std::vector<ElfSectionHeader> section_headers;
+    section_headers.reserve(header.section_header_table_entry_count);
+    for(size_t a = 0; a < header.section_header_table_entry_count; ++a)
     {
-        for(auto &section : elf.section_headers)
+        ElfSectionHeader section_header = parse_section_header64(&table[a * entry_size]);
+
+        //nobits sections take up no space in the file, everything else must be within it
+        if(section_header.type != ElfSectionHeader::Type::null && section_header.type != ElfSectionHeader::Type::nobits)
         {
-            if(section.type == ElfSectionHeader::Type::null)
-                continue;
-            auto &strtab = elf.section_headers[elf.header.section_header_name_index];
-            section.name.append(&elf.binary_data.at(strtab.file_offset + section.name_strtab_offset));
+            if(!in_file(section_header.file_offset, section_header.file_size, file_size))
+                throw std::logic_error("Section header " + std::to_string(a) + " lies outside of the file");
         }
+        section_headers.emplace_back(std::move(section_header));
     }
-    else
+    return section_headers;
+}
+
+void ElfParser::check_section_names(const std::vector<ElfSectionHeader> &section_headers, uint64_t strtab_size, char strtab_last)
+{
+    //A table ending in a null proves every name starting within it is terminated, without scanning any of them
+    for(const auto &section : section_headers)
     {
-        std::cout << "Invalid section name index found in header. Not filling in section names." << std::endl;
+        if(section.type == ElfSectionHeader::Type::null)
+            continue;
+        if(section.name_strtab_offset >= strtab_size || strtab_last != '\0')
+            throw std::logic_error("Section name lies outside of the section name table");
     }
+}
 
-    return elf;
+void ElfParser::fill_section_names(std::vector<ElfSectionHeader> &section_headers, std::string_view strtab)
+{
+    check_section_names(section_headers, strtab.size(), strtab.empty() ? '\0' : strtab.back());
+    for(auto &section : section_headers)
+    {
+        if(section.type == ElfSectionHeader::Type::null)
+            continue;
+
+        //Names can overlap, so cap their length, else every section could copy the same huge name
+        std::string_view name = strtab.substr(section.name_strtab_offset, max_section_name_length);
+        section.name.assign(name.substr(0, name.find('\0')));
+    }
 }
 
-ElfProgramHeader ElfParser::parse_program_header64(std::ifstream &elf_stream)
+ElfProgramHeader ElfParser::parse_program_header64(const char *entry)
 {
     ElfProgramHeader header{};
-    elf_stream.read((char*)&header.type, sizeof(header.type));
-    elf_stream.read((char*)&header.flags, sizeof(header.flags));
-    elf_stream.read((char*)&header.file_offset, sizeof(header.file_offset));
-    elf_stream.read((char*)&header.mem_offset, sizeof(header.file_offset));
-    elf_stream.seekg(8, std::ifstream::cur); //Reserved
-    elf_stream.read((char*)&header.file_size, sizeof(header.file_size));
-    elf_stream.read((char*)&header.mem_size, sizeof(header.mem_size));
-    elf_stream.read((char*)&header.alignment, sizeof(header.alignment));
+    memcpy(&header.type, entry + 0, sizeof(header.type));
+    memcpy(&header.flags, entry + 4, sizeof(header.flags));
+    memcpy(&header.file_offset, entry + 8, sizeof(header.file_offset));
+    memcpy(&header.mem_offset, entry + 16, sizeof(header.mem_offset));
+    //24: Reserved
+    memcpy(&header.file_size, entry + 32, sizeof(header.file_size));
+    memcpy(&header.mem_size, entry + 40, sizeof(header.mem_size));
+    memcpy(&header.alignment, entry + 48, sizeof(header.alignment));
     return header;
 }
 
-ElfSectionHeader ElfParser::parse_section_header64(std::ifstream &elf_stream)
+ElfSectionHeader ElfParser::parse_section_header64(const char *entry)
 {
     ElfSectionHeader header{};
-    elf_stream.read((char*)&header.name_strtab_offset, sizeof(header.name_strtab_offset));
-    elf_stream.read((char*)&header.type, sizeof(header.type));
-    elf_stream.read((char*)&header.flags, sizeof(header.flags));
-    elf_stream.read((char*)&header.mem_offset, sizeof(header.mem_offset));
-    elf_stream.read((char*)&header.file_offset, sizeof(header.file_offset));
-    elf_stream.read((char*)&header.file_size, sizeof(header.file_size));
-    elf_stream.read((char*)&header.link, sizeof(header.link));
-    elf_stream.read((char*)&header.info, sizeof(header.info));
-    elf_stream.read((char*)&header.alignment, sizeof(header.alignment));
-    elf_stream.read((char*)&header.entry_size, sizeof(header.entry_size));
+    memcpy(&header.name_strtab_offset, entry + 0, sizeof(header.name_strtab_offset));
+    memcpy(&header.type, entry + 4, sizeof(header.type));
+    memcpy(&header.flags, entry + 8, sizeof(header.flags));
+    memcpy(&header.mem_offset, entry + 16, sizeof(header.mem_offset));
+    memcpy(&header.file_offset, entry + 24, sizeof(header.file_offset));
+    memcpy(&header.file_size, entry + 32, sizeof(header.file_size));
+    memcpy(&header.link, entry + 40, sizeof(header.link));
+    memcpy(&header.info, entry + 44, sizeof(header.info));
+    memcpy(&header.alignment, entry + 48, sizeof(header.alignment));
+    memcpy(&header.entry_size, entry + 56, sizeof(header.entry_size));
     return header;
 }
@@ -0,0 +1,175 @@
+//
+// CPU affinity and NUMA memory placement for launched programs.
+//
+
+#include <ElfPlacement.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <cstring>
+
+//Largest node ID we support. Masks passed to the kernel must be at least as large as its MAX_NUMNODES.
+static constexpr size_t max_nodes = 1024;
+static constexpr size_t bits_per_long = sizeof(unsigned long) * 8;
+
+/*!
+ * Parses a sysfs list, such as "0-3,8,10-11", into a list of IDs
+ */
+static std::vector<int> parse_id_list(const std::string &filepath)
+{
+    std::ifstream stream(filepath);
+    if(!stream.is_open())
+        throw std::runtime_error("Couldn't open '" + filepath + "': " + std::to_string(errno));
+
+    std::string list;
+    std::getline(stream, list);
+
+    std::vector<int> ids;
+    size_t pos = 0;
+    while(pos < list.size())
+    {
+        auto range_end = list.find(',', pos);
+        if(range_end == std::string::npos)
+            range_end = list.size();
+        std::string range = list.substr(pos, range_end - pos);
+        auto dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+        for(int id = first; id <= last; ++id)
+            ids.emplace_back(id);
+        pos = range_end + 1;
+    }
+    return ids;
+}
+
+void ElfPlacement::apply(const ElfLaunchOptions &options)
+{
+    if(!options.cpus.empty())
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for(auto cpu : options.cpus)
+        {
+            if(cpu < 0 || cpu >= CPU_SETSIZE)
+                throw std::runtime_error("Invalid CPU ID: " + std::to_string(cpu));
+            CPU_SET(cpu, &set);
+        }
+        if(sched_setaffinity(0, sizeof(set), &set) != 0)
+            throw std::runtime_error("Failed to set CPU affinity: " + std::to_string(errno));
+    }
+
+    set_memory_policy(options.memory_policy, options.numa_nodes);
+}
+
+void ElfPlacement::set_memory_policy(ElfLaunchOptions::MemoryPolicy policy, const std::vector<int> &nodes)
+{
+    int mode;
+    switch(policy)
+    {
+        case ElfLaunchOptions::MemoryPolicy::inherit:
+            return;
+        case ElfLaunchOptions::MemoryPolicy::local:
+            if(syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) != 0)
+                throw std::runtime_error("Failed to set local memory policy: " + std::to_string(errno));
+            return;
+        case ElfLaunchOptions::MemoryPolicy::bind:
+            mode = MPOL_BIND;
+            break;
+        case ElfLaunchOptions::MemoryPolicy::preferred:
+            mode = MPOL_PREFERRED;
+            break;
+        case ElfLaunchOptions::MemoryPolicy::interleave:
+            mode = MPOL_INTERLEAVE;
+            break;
+    }
+
+    if(nodes.empty())
+        throw std::runtime_error("NUMA memory policy requires at least one node");
+
+    //Preferred only takes a single node, use the first
+    std::vector<unsigned long> mask(max_nodes / bits_per_long, 0);
+    for(size_t a = 0; a < nodes.size(); ++a)
+    {
+        if(nodes[a] < 0 || (size_t)nodes[a] >= max_nodes)
+            throw std::runtime_error("Invalid NUMA node ID: " + std::to_string(nodes[a]));
+        mask[nodes[a] / bits_per_long] |= 1UL << (nodes[a] % bits_per_long);
+        if(mode == MPOL_PREFERRED)
+            break;
+    }
+
+    if(syscall(SYS_set_mempolicy, mode, mask.data(), max_nodes + 1) != 0)
+        throw std::runtime_error("Failed to set memory policy: " + std::to_string(errno));
+}
+
+int ElfPlacement::node_of(void *addr)
+{
+    int node = -1;
+    if(syscall(SYS_get_mempolicy, &node, nullptr, 0, addr, MPOL_F_NODE | MPOL_F_ADDR) != 0)
+        throw std::runtime_error("Failed to get node of address: " + std::to_string(errno));
+    return node;
+}
+
+std::vector<int> ElfPlacement::node_cpus(int node)
+{
+    return parse_id_list("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+}
+
+std::vector<int> ElfPlacement::memory_nodes()
+{
+    try
+    {
+        return parse_id_list("/sys/devices/system/node/has_memory");
+    }
+    catch(const std::exception &e)
+    {
+        //No NUMA support, everything is on node 0
+        return {0};
+    }
+}
+
+ElfPlacement::ScopedPlacement::ScopedPlacement(const ElfLaunchOptions &options)
+{
+    if(!options.cpus.empty())
+    {
+        if(sched_getaffinity(0, sizeof(old_affinity), &old_affinity) != 0)
+            throw std::runtime_error("Failed to get CPU affinity: " + std::to_string(errno));
+        restore_affinity = true;
+    }
+
+    if(options.memory_policy != ElfLaunchOptions::MemoryPolicy::inherit)
+    {
+        old_mask.resize(max_nodes / bits_per_long, 0);
+        if(syscall(SYS_get_mempolicy, &old_mode, old_mask.data(), max_nodes + 1, nullptr, 0) != 0)
+            throw std::runtime_error("Failed to get memory policy: " + std::to_string(errno));
+        restore_policy = true;
+    }
+
+    try
+    {
+        apply(options);
+    }
+    catch(const std::exception &e)
+    {
+        restore();
+        throw;
+    }
+}
+
+ElfPlacement::ScopedPlacement::~ScopedPlacement()
+{
+    restore();
+}
+
+void ElfPlacement::ScopedPlacement::restore()
+{
+    if(restore_affinity)
+        sched_setaffinity(0, sizeof(old_affinity), &old_affinity);
+    if(restore_policy)
+        syscall(SYS_set_mempolicy, old_mode, old_mask.data(), max_nodes + 1);
+    restore_affinity = false;
+    restore_policy = false;
+}